@@ -23,9 +23,19 @@
 #include <cmath>
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <string>
+#include <tuple>
+#include <cstdint>
+#include <limits>
 
 #define N 50
 #define NTHREADS 8
+#define BATCH 64
+#define MAX_STEPS 100000
+#define SERIAL_THRESHOLD 65536
+#define INDEX_BINS 64
+#define MAX_REGISTERS 256
 
 /*------------------------TOOLS------------------------*/
 /**
@@ -42,7 +52,17 @@ public:
      * @param value Initial value for all elements
      */
 	explicit Array(const unsigned long int size, const double value = 0.0) : data(size, value) {}
-	
+    /**
+     * @brief Copy-constructs from another Array
+     * @param other Source array to copy from
+     */
+	Array(const Array& other) : data(other.data) {}
+    /**
+     * @brief Move-constructs from another Array
+     * @param other Source array to move from
+     */
+	Array(Array&& other) : data(std::move(other.data)) {}
+
     /** @brief Returns the number of elements in the array. */
 	unsigned long int size() const;
     /**
@@ -104,6 +124,86 @@ public:
 	
 };
 
+namespace Simulator {
+
+/**
+ * @brief Sorts keys in ascending order with a parallel LSD radix sort (serial below SERIAL_THRESHOLD keys), carrying values along
+ * @param keys In/out 32 bits keys
+ * @param values In/out values permuted together with the keys
+ */
+void radix_sort(std::vector<std::uint32_t>& keys, std::vector<unsigned long int>& values);
+
+/**
+ * @brief Computes max |a[i] - b[i]| with a parallel reduction over std::threads, serially below SERIAL_THRESHOLD elements
+ * @param a First array
+ * @param b Second array, same size as a
+ * @return Largest absolute difference (0 for empty arrays)
+ */
+double max_abs_difference(Array const& a, Array const& b);
+
+} //Simulator
+
+/**
+ * @brief Space-filling-curve ordering of the particle arrays
+ *
+ * Particles are sorted by the curve key of their position every `period` steps so that
+ * neighbours in space stay neighbours in memory. In 1D the Morton/Hilbert key reduces to the
+ * quantized position. ids keeps the original ID of each slot so outputs are still written in
+ * original ID order.
+ */
+class SpatialOrder{
+	unsigned int period = 0;
+	bool sorted = false;
+	std::vector<unsigned long int> ids;
+	std::vector<unsigned long int> perm;
+public:
+    /** @brief Constructs an empty ordering. */
+	SpatialOrder() = default;
+    /**
+     * @brief Constructs the identity ordering for a given number of particles
+     * @param size Number of particles
+     */
+	explicit SpatialOrder(const unsigned long int size);
+    /**
+     * @brief Sets the reordering period
+     * @param k Number of steps between two reorderings (0 disables reordering)
+     */
+	void set_period(unsigned int k);
+    /**
+     * @brief Tells whether the particles must be reordered after a step
+     * @param step Index of the step just computed (starting at 1)
+     */
+	bool due(unsigned long int step) const;
+    /**
+     * @brief Computes the permutation sorting the particles by curve key and updates the ids
+     * @param positions Particle positions
+     */
+	void sort(Array const& positions);
+    /**
+     * @brief Applies the last permutation computed by sort() to an array
+     * @param values In/out particle values
+     */
+	void permute(Array& values) const;
+    /**
+     * @brief Returns the original ID of the particle stored at a slot
+     * @param i Slot index
+     */
+	unsigned long int id(unsigned long int i) const;
+    /**
+     * @brief Prints particle values in original ID order
+     * @param values Particle values in memory order
+     * @param file Output file stream
+     */
+	void print(Array const& values, std::ofstream& file) const;
+    /**
+     * @brief Puts particle values back in original ID order
+     * @param values In/out particle values, in memory order on input
+     */
+	void restore(Array& values) const;
+    /** @brief Forgets the ordering, to be called once every array was restored. */
+	void reset();
+};
+
 /*------------------------GASFIELD------------------------*/
 /**
  * @brief Abstract gas field interface providing velocity as a function of position and time
@@ -116,6 +216,14 @@ struct GasField{
      * @return Velocity at the given position and time
      */
 	virtual double velocity(double positions, double time) = 0;
+    /**
+     * @brief Computes the velocities of a whole array of positions at a time
+     * @param velocities Output velocities (n values)
+     * @param positions Input positions (n values)
+     * @param n Number of positions
+     * @param time Simulation time
+     */
+	virtual void velocities(double* velocities, const double* positions, unsigned long int n, double time);
 	virtual ~GasField() = default;
 };
 /** @brief Gas field with constant velocity. */
@@ -127,6 +235,14 @@ struct ConstantGasField : GasField{
 	 * @return Velocity at the given position and time
 	 */
 	double velocity(double positions, double time) override;
+	/**
+	 * @brief Computes the velocities of a whole array of positions at a time
+	 * @param velocities Output velocities (n values)
+	 * @param positions Input positions (n values)
+	 * @param n Number of positions
+	 * @param time Simulation time
+	 */
+	void velocities(double* velocities, const double* positions, unsigned long int n, double time) override;
 };
 
 /** @brief Gas field with spatially or temporally varying velocity. */
@@ -138,6 +254,131 @@ struct NonUniformGasField :  GasField{
 	 * @return Velocity at the given position and time
 	 */
 	double velocity(double positions, double time) override;
+	/**
+	 * @brief Computes the velocities of a whole array of positions at a time
+	 * @param velocities Output velocities (n values)
+	 * @param positions Input positions (n values)
+	 * @param n Number of positions
+	 * @param time Simulation time
+	 */
+	void velocities(double* velocities, const double* positions, unsigned long int n, double time) override;
+};
+
+/**
+ * @brief Gas field defined by an expression of the position x and the time t
+ *
+ * The expression is compiled once into a register program. Each instruction is then run over a
+ * batch of BATCH positions at a time, so the interpretation cost is paid per batch rather than
+ * per particle and the lane loops can be vectorized. Supports numbers, x, t, pi, + - * / ^,
+ * parentheses and sin, cos, tan, exp, log, sqrt, abs, tanh.
+ */
+struct ExpressionGasField : GasField{
+    /**
+     * @brief Compiles an expression, exits on syntax errors or past MAX_REGISTERS registers
+     * @param expression Velocity as a function of x and t, e.g. "sin(-pi*x)"
+     */
+	explicit ExpressionGasField(std::string const& expression);
+	/**
+	 * @brief Computes the velocity at a position and time
+	 * @param positions Position value
+	 * @param time Time step value
+	 * @return Velocity at the given position and time
+	 */
+	double velocity(double positions, double time) override;
+	/**
+	 * @brief Computes the velocities of a whole array of positions at a time
+	 * @param velocities Output velocities (n values)
+	 * @param positions Input positions (n values)
+	 * @param n Number of positions
+	 * @param time Simulation time
+	 */
+	void velocities(double* velocities, const double* positions, unsigned long int n, double time) override;
+	
+private:
+	enum class Op{Add, Sub, Mul, Div, Pow, Neg, Sin, Cos, Tan, Exp, Log, Sqrt, Abs, Tanh};
+	/** @brief Register instruction: dst = op(a, b). */
+	struct Instruction{
+		Op op;
+		unsigned int dst, a, b;
+	};
+	//Registers 0 and 1 hold x and t, constants are loaded once per call
+	std::vector<Instruction> program;
+	std::vector<std::pair<unsigned int, double>> constants;
+	unsigned int nregisters = 2;
+	unsigned int result = 0;
+	
+	//Recursive descent compiler, each rule returns the register holding its value
+	std::string source;
+	std::size_t cursor = 0;
+	unsigned int parse_sum();
+	unsigned int parse_product();
+	unsigned int parse_unary();
+	unsigned int parse_power();
+	unsigned int parse_primary();
+	unsigned int emit(Op op, unsigned int a, unsigned int b = 0);
+	unsigned int constant(double value);
+	static double apply(Op op, double a, double b);
+	bool accept(char c);
+	void fail(const char* message) const;
+};
+
+/*------------------------SPECIES------------------------*/
+/**
+ * @brief Per-species properties of a transported pollutant
+ */
+struct Species{
+	std::string name;
+	double settling_velocity = 0.0;
+	double decay_rate = 0.0;
+	/** Turbulent deposition velocity per unit of local wind speed */
+	double transfer_coefficient = 0.0;
+};
+
+/**
+ * @brief State of the species carried by the particles
+ *
+ * Each particle carries every species, so the species stay attached to the particle and share
+ * the wind evaluated once at its position. The simulated axis is horizontal, so settling does
+ * not move a species along it: it is a dry-deposition loss of mass over the mixing height, with a
+ * deposition velocity settling_velocity + transfer_coefficient * |u| growing with the local wind
+ * u of the particle, so masses differ between particles. Masses are stored one Array per species
+ * so that the per-species loops run over contiguous memory.
+ */
+class SpeciesSet{
+public:
+	std::vector<Species> species;
+	std::vector<Array> mass;
+	double mixing_height = 1.0;
+	
+    /**
+     * @brief Adds a species to the set, exits on a negative settling velocity, decay rate or transfer coefficient
+     * @param s Species properties
+     */
+	void add(Species const& s);
+    /** @brief Returns the number of species. */
+	unsigned long int size() const;
+    /**
+     * @brief Gives every species a unit mass on each particle and truncates the output files
+     * @param nbpart Number of particles
+     * @param path Output path for results
+     */
+	void initialize(unsigned long int nbpart, std::string const& path);
+    /**
+     * @brief Applies the last permutation of a spatial ordering to every species array
+     * @param order Spatial ordering of the particles
+     */
+	void permute(SpatialOrder const& order);
+    /**
+     * @brief Puts every species array back in original ID order
+     * @param order Spatial ordering of the particles
+     */
+	void restore(SpatialOrder const& order);
+    /**
+     * @brief Appends the masses of every species to path_<name>_mass.csv
+     * @param path Output path for results
+     * @param order Spatial ordering giving the original IDs
+     */
+	void print(std::string const& path, SpatialOrder const& order) const;
 };
 
 /*------------------------MODEL------------------------*/
@@ -160,6 +401,32 @@ struct Model{
      * @param time Time step value
      */
 	void compute_positions(Array& positions, Array const& velocities, double time);
+    /**
+     * @brief Computes particle velocities from positions at a given time
+     * @param velocities Output velocities (n values)
+     * @param positions Input positions (n values)
+     * @param n Number of particles
+     * @param time Time step value
+     */
+	void compute_velocities(double* velocities, const double* positions, unsigned long int n, double time);
+    /**
+     * @brief Updates particle positions using velocities at a given time
+     * @param positions In/out positions (n values)
+     * @param velocities Input velocities (n values)
+     * @param n Number of particles
+     * @param time Time step value
+     */
+	void compute_positions(double* positions, const double* velocities, unsigned long int n, double time);
+    /**
+     * @brief Updates the species masses after the particles were advected
+     *
+     * The species ride the particles advected with the shared wind evaluation, each species
+     * then loses mass by decay and by deposition driven by the wind of its particle.
+     * @param species In/out species state
+     * @param velocities Wind evaluated at the particles for this step
+     * @param time Time step value
+     */
+	void compute_species(SpeciesSet& species, Array const& velocities, double time);
 	
 	~Model() {gastype.reset();}
 };
@@ -183,7 +450,8 @@ enum class ParticlesInit_mod{
 /** @brief Gas field type used by the model. */
 enum class GasType{
 	Constant,
-	NonUniform
+	NonUniform,
+	Expression
 };
 
 /**
@@ -221,20 +489,176 @@ Simulator::ParticlesInit_mod userChoice_ParticlesInit(const char * arg);
  */
 Simulator::GasType userChoice_GasType(const char * arg);
 
+/**
+ * @brief Creates the gas field of a given type
+ * @param Gas_type Gas field type
+ * @param expression Velocity as a function of x and t, used by GasType::Expression
+ * @return Gas field for the model
+ */
+std::unique_ptr<GasField> make_gas_field(GasType const& Gas_type, std::string const& expression);
+
+/**
+ * @brief Returns the initial position of a particle discretized over [-1, 1)
+ * @param i Particle index
+ * @param nbpart Number of particles
+ */
+double discretized_position(unsigned long int i, unsigned long int nbpart);
+
+/*------------------------RECEPTOR INDEX------------------------*/
+/**
+ * @brief Spatial binning used to index the trajectory output (nbins = 0 disables the index)
+ */
+struct ReceptorGrid{
+	unsigned int nbins = 0;
+	double xmin = -1.0;
+	double xmax = 1.0;
+	
+	/**
+	 * @brief Returns the bin of a position: 1 to nbins inside [xmin, xmax), 0 below and nbins+1 above
+	 * @param position Position value
+	 */
+	unsigned int bin(double position) const;
+	/** @brief Returns the width of an inner bin. */
+	double width() const;
+	/**
+	 * @brief Returns the lower bound of an inner bin
+	 * @param b Inner bin (1 to nbins)
+	 */
+	double lower(unsigned int b) const;
+};
+
+/**
+ * @brief Writes the receptor index while the trajectory is exported
+ *
+ * For every exported step, the 32-bit particle IDs are grouped by bin after the bin bounds, each
+ * with its position inside the bin quantized on 16 bits, so border bins are filtered without
+ * the exact positions. Only particles outside the grid keep their exact position. A table of
+ * the step times and block offsets is written at the end of the file, so a query only reads the
+ * blocks and bins it needs.
+ */
+class ReceptorIndexWriter{
+	ReceptorGrid grid;
+	std::ofstream file;
+	std::vector<double> times;
+	std::vector<std::uint64_t> offsets;
+	unsigned long int nbpart = 0;
+public:
+    /**
+     * @brief Opens path_index.bin if the grid has bins, otherwise does nothing
+     * @param path Output path for results
+     * @param receptor_grid Spatial binning of the index
+     */
+	ReceptorIndexWriter(std::string const& path, ReceptorGrid const& receptor_grid);
+    /**
+     * @brief Indexes the particles positions of an exported step
+     * @param t Time of the step
+     * @param positions Particle positions in memory order
+     * @param order Spatial ordering giving the original IDs
+     */
+	void add_step(double t, Array const& positions, SpatialOrder const& order);
+    /** @brief Writes the step table and closes the file. */
+	void close();
+	~ReceptorIndexWriter(){close();}
+};
+
+/**
+ * @brief Answers region x time-window queries on an index written by ReceptorIndexWriter
+ *
+ * Every read is checked against the file size, a corrupt index stops the program.
+ */
+class ReceptorIndex{
+	std::string filename;
+	std::ifstream file;
+	ReceptorGrid grid;
+	unsigned long int nbpart = 0;
+	std::vector<double> times;
+	std::vector<std::uint64_t> offsets;
+	std::uint64_t table_offset = 0;
+	
+	/** @brief Exits with an error if the index is corrupt. */
+	void check(bool valid) const;
+	/** @brief Reads size bytes at offset, exits if they are not in the file. */
+	void read_at(std::uint64_t offset, void* data, std::uint64_t size);
+public:
+    /**
+     * @brief Opens an index file and loads its step table
+     * @param filename Index file (path_index.bin)
+     */
+	explicit ReceptorIndex(std::string const& filename);
+    /** @brief Returns the number of indexed steps. */
+	unsigned long int steps() const;
+    /**
+     * @brief Lists the particles found in [xmin, xmax] at a step of [tmin, tmax]
+     *
+     * Inside the grid, a particle is kept if its 16-bit cell overlaps the region, so particles
+     * closer than width/65536 to the region may be reported.
+     * @param xmin Lower bound of the receptor region
+     * @param xmax Upper bound of the receptor region
+     * @param tmin Start of the time window
+     * @param tmax End of the time window
+     * @return Sorted original IDs of the particles
+     */
+	std::vector<unsigned long int> query(double xmin, double xmax, double tmin, double tmax);
+};
+
 /*------------------------SIMULATOR------------------------*/
+/**
+ * @brief End condition of an unsteady run
+ *
+ * The run stops at the time horizon, or as soon as the largest particle displacement over one
+ * step falls below the tolerance. An infinite horizon with a tolerance gives an open-ended run
+ * that stops on convergence only. max_steps caps every run, so fields that never converge
+ * still end.
+ */
+struct EndCondition{
+	double horizon = 1.0;
+	double tolerance = 0.0;
+	unsigned long int max_steps = MAX_STEPS;
+	
+	EndCondition() = default;
+	/**
+	 * @param horizon_time Final time of the run (may be infinite)
+	 * @param convergence_tolerance Max displacement per step below which the run stops (0 disables)
+	 * @param steps_cap Number of steps after which the run stops anyway
+	 */
+	EndCondition(double horizon_time, double convergence_tolerance = 0.0, unsigned long int steps_cap = MAX_STEPS) : horizon(horizon_time), tolerance(convergence_tolerance), max_steps(steps_cap){}
+	
+	/**
+	 * @brief Tells whether the run is over
+	 * @param step Number of steps computed
+	 * @param t Current time
+	 * @param change Largest particle displacement over the last step
+	 */
+	bool reached(unsigned long int step, double t, double change) const;
+	/**
+	 * @brief Returns the number of steps after which reached() holds for a run that never converges
+	 * @param dt Time step
+	 */
+	unsigned long int steps(double dt) const;
+};
+
 /**
  * @brief Abstract simulator strategy that advances the system state
  */
 class Simulator{
+protected:
+	ReceptorGrid grid;
 public:
+    /**
+     * @brief Enables the receptor index of the exported trajectory
+     * @param receptor_grid Spatial binning of the index
+     */
+	void index_on(ReceptorGrid const& receptor_grid){grid = receptor_grid;}
     /**
      * @brief Performs the simulation step(s)
      * @param positions In/out particle positions
      * @param velocities In/out particle velocities
+     * @param species In/out species carried by the particles
      * @param particle_model Model used to compute updates
+     * @param order Spatial ordering of the particles
      * @param path Output path for results
      */
-	virtual void compute(Array& positions, Array& velocities, Model& particle_model, std::string& path) = 0;
+	virtual void compute(Array& positions, Array& velocities, SpeciesSet& species, Model& particle_model, SpatialOrder& order, std::string& path) = 0;
 	virtual ~Simulator() = default;
 	
 };
@@ -246,24 +670,36 @@ public:
 	 * @brief Performs the simulation step(s)
 	 * @param positions In/out particle positions
 	 * @param velocities In/out particle velocities
+	 * @param species In/out species carried by the particles
 	 * @param particle_model Model used to compute updates
+	 * @param order Spatial ordering of the particles
 	 * @param path Output path for results
 	 */
-	void compute(Array& positions, Array& velocities, Model& particle_model, std::string& path) override;
+	void compute(Array& positions, Array& velocities, SpeciesSet& species, Model& particle_model, SpatialOrder& order, std::string& path) override;
 	
 };
 
 /** @brief Simulator for unsteady computations. */
 class UnsteadySimulator : public Simulator{
+	EndCondition end;
 public:
+	UnsteadySimulator() = default;
+	/**
+	 * @brief Constructs an unsteady simulator with a given end condition
+	 * @param end_condition When to stop the time loop
+	 */
+	explicit UnsteadySimulator(EndCondition const& end_condition) : end(end_condition){}
+	
 	/**
 	 * @brief Performs the simulation steps
 	 * @param positions particle positions
 	 * @param velocities particle velocities
+	 * @param species species carried by the particles
 	 * @param particle_model Model used to compute updates
+	 * @param order Spatial ordering of the particles
 	 * @param path Output path for results
 	 */
-	void compute(Array& positions, Array& velocities, Model& particle_model, std::string& path) override;
+	void compute(Array& positions, Array& velocities, SpeciesSet& species, Model& particle_model, SpatialOrder& order, std::string& path) override;
 	
 };
 
@@ -275,6 +711,11 @@ class Particles{
 	Model model;
 	std::unique_ptr<Simulator> sim = nullptr;
 	ComputeType __computeType;
+	SpatialOrder order;
+	EndCondition end;
+	ReceptorGrid grid;
+	SpeciesSet species;
+	std::string gas_expression;
 	unsigned long int nbpart = 0;
 public:
 	Array position;
@@ -286,12 +727,59 @@ public:
      * @brief Constructs particles arrays with a given number of particles
      * @param i Number of particles
      */
-	Particles(unsigned int i){
+	Particles(unsigned int i) : order(i){
 		nbpart = i;
 		position.resize(i);
 		velocity.resize(i);
 	}
 	
+    /**
+     * @brief Enables the space-filling-curve reordering of the particle arrays
+     *
+     * The arrays are only reordered while compute() runs: outputs are written in particle ID
+     * order and position/velocity are given back in particle ID order when compute() returns.
+     * @param k Number of steps between two reorderings (0 disables reordering)
+     */
+	void reorder_every(unsigned int k);
+	
+    /**
+     * @brief Sets the end condition of unsteady runs, to be called before initialize
+     *
+     * Exits on a NaN or non-positive horizon, a negative tolerance, a zero steps cap, or an
+     * infinite horizon without a tolerance.
+     * @param end_condition Time horizon and convergence tolerance
+     */
+	void set_end_condition(EndCondition const& end_condition);
+	
+    /**
+     * @brief Builds a receptor index (path_index.bin) while writing output, to be called before initialize
+     * @param nbins Number of spatial bins
+     * @param xmin Lower bound of the binned region
+     * @param xmax Upper bound of the binned region
+     */
+	void build_index(unsigned int nbins, double xmin = -1.0, double xmax = 1.0);
+	
+    /**
+     * @brief Adds a species carried by every particle, to be called before initialize
+     * @param s Species properties
+     */
+	void add_species(Species const& s);
+	
+    /** @brief Returns the species carried by the particles. */
+	SpeciesSet const& carried_species() const;
+	
+    /**
+     * @brief Sets the mixing height over which settling species deposit
+     * @param height Mixing height, same unit as the positions
+     */
+	void set_mixing_height(double height);
+	
+    /**
+     * @brief Sets the expression of the GasType::Expression field, to be called before initialize
+     * @param expression Velocity as a function of x and t
+     */
+	void set_gas_expression(std::string const& expression);
+	
     /**
      * @brief Initializes the particles, model and simulator according to configuration
      * @param Sim_type Compute mode
@@ -324,6 +812,68 @@ public:
 	~Particles() {sim.reset();}
 };
 
+/*------------------------OUT-OF-CORE PARTICLES------------------------*/
+/**
+ * @brief Particles whose state lives in a memory-mapped file rather than in RAM
+ *
+ * The file holds the nbpart positions followed by the nbpart velocities. Since the update is
+ * independent for each particle, compute() streams the file chunk by chunk and runs every time
+ * step on a chunk before moving to the next one, split over NTHREADS threads. A helper thread
+ * prefetches the next chunk while the current one is computed, and finished chunks are handed
+ * to the kernel for asynchronous write-back. Only the final state is kept in the file: no
+ * trajectory CSV, receptor index or species are written.
+ */
+class OutOfCoreParticles{
+	Model model;
+	EndCondition end;
+	std::string gas_expression;
+	unsigned long int nbpart = 0;
+	unsigned long int chunk = 0;
+	int fd = -1;
+	double* state = nullptr;
+public:
+    /**
+     * @brief Creates (or reopens) and maps the state file
+     * @param i Number of particles
+     * @param filename State file
+     * @param chunk_size Number of particles streamed through memory at a time
+     */
+	OutOfCoreParticles(unsigned long int i, std::string const& filename, unsigned long int chunk_size = 1 << 20);
+	OutOfCoreParticles(const OutOfCoreParticles&) = delete;
+	OutOfCoreParticles& operator=(const OutOfCoreParticles&) = delete;
+	
+    /**
+     * @brief Sets the final time of the run, exits if it is not positive and finite
+     *
+     * Runs are capped at MAX_STEPS steps like the in-memory ones, convergence tolerances need a
+     * global reduction per step and are not supported.
+     * @param horizon_time Final time
+     */
+	void set_horizon(double horizon_time);
+    /**
+     * @brief Sets the expression of the GasType::Expression field, to be called before initialize
+     * @param expression Velocity as a function of x and t
+     */
+	void set_gas_expression(std::string const& expression);
+    /**
+     * @brief Initializes the particles state and the model
+     * @param Pos_type Particles initialization mode
+     * @param Gas_type Gas field type
+     */
+	void initialize(ParticlesInit_mod const& Pos_type, GasType const& Gas_type);
+    /** @brief Runs the unsteady simulation chunk by chunk. */
+	void compute();
+	
+    /** @brief Returns the number of particles. */
+	unsigned long int size() const;
+    /** @brief Returns the mapped positions (size() values). */
+	const double* position() const;
+    /** @brief Returns the mapped velocities (size() values). */
+	const double* velocity() const;
+	
+	~OutOfCoreParticles();
+};
+
 /*------------------------CHRONO------------------------*/
 /**
  * @brief Chronometer for runtime computing
@@ -357,6 +907,7 @@ public:
 struct Problem{
 	unsigned int nb_particles;
 	const char ** argv;
+	unsigned int index_bins = 0;
 	Problem(const char ** args) : argv(args){nb_particles = 16;}
 	Problem(unsigned int nbparticles, const char ** args) : nb_particles(nbparticles), argv(args){}
 	~Problem() = default;
@@ -0,0 +1,52 @@
+//
+//  bench.cpp
+//  air-pollution-simulator
+//
+//  Benchmark of an expression-compiled gas field against the hand-written NonUniformGasField.
+//
+
+#include <iostream>
+#include <cstdlib>
+#include "simulator.hpp"
+
+
+
+/**
+ * @brief Times nbsteps unsteady steps of a model over nbparticles particles, as UnsteadySimulator runs them
+ */
+static std::chrono::milliseconds bench_model(Model& model, unsigned long int nbparticles, unsigned int nbsteps){
+	Array positions(nbparticles);
+	Array velocities(nbparticles, 1.0);
+	for (unsigned long int i = 0; i<nbparticles; ++i){
+		positions[i] = Simulator::discretized_position(i, nbparticles);
+	}
+	
+	const double dt = 1.0/(double)N;
+	Simulator::Chrono timer;
+	timer.start();
+	for (unsigned int step = 0; step<nbsteps; ++step){
+		model.compute_velocities(velocities, positions, (double)step*dt);
+		model.compute_positions(positions, velocities, dt);
+	}
+	timer.stop();
+	return timer.runtime();
+}
+
+int main(int argc, const char * argv[]) {
+	const unsigned long int nbparticles = argc > 1 ? atol(argv[1]) : 1000000;
+	const unsigned int nbsteps = argc > 2 ? atoi(argv[2]) : N;
+	
+	Model handwritten;
+	handwritten.gastype = std::make_unique<NonUniformGasField>();
+	Model expression;
+	expression.gastype = std::make_unique<ExpressionGasField>("sin(-pi*x)");
+	
+	const auto reference = bench_model(handwritten, nbparticles, nbsteps);
+	const auto compiled = bench_model(expression, nbparticles, nbsteps);
+	
+	std::cout << "--- " << nbparticles << " particles, " << nbsteps << " steps ---" << std::endl;
+	std::cout << "--- NonUniformGasField: " << (float)reference.count()/1000.0f << "s ---" << std::endl;
+	std::cout << "--- ExpressionGasField(sin(-pi*x)): " << (float)compiled.count()/1000.0f << "s ---" << std::endl;
+	
+	return 0;
+}
@@ -14,18 +14,27 @@
 
 
 int main(int argc, const char * argv[]) {
-	if (argc != 4){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform)\n");}
+	//A trailing "index" writes the receptor index of the trajectory
+	const bool index = argc > 4 && strcmp(argv[argc-1], "index") == 0;
+	if (index){
+		--argc;
+	}
 	
-	if (!(strcmp(argv[1], "steady") == 0 || strcmp(argv[1], "unsteady") == 0)){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform)\n");}
+	if (argc != 4 && !(argc == 5 && strcmp(argv[3], "expression") == 0)){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform, expression \"<f(x,t)>\") [index]\n");}
 	
+	if (!(strcmp(argv[1], "steady") == 0 || strcmp(argv[1], "unsteady") == 0)){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform, expression \"<f(x,t)>\") [index]\n");}
 	
-	if (!(strcmp(argv[2], "localized") == 0 || strcmp(argv[2], "discretized") == 0)){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform)\n");}
 	
+	if (!(strcmp(argv[2], "localized") == 0 || strcmp(argv[2], "discretized") == 0)){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform, expression \"<f(x,t)>\") [index]\n");}
 	
-	if (!(strcmp(argv[3], "constant") == 0 || strcmp(argv[3], "nonuniform") == 0)){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform)\n");}
+	
+	if (!(strcmp(argv[3], "constant") == 0 || strcmp(argv[3], "nonuniform") == 0 || (strcmp(argv[3], "expression") == 0 && argc == 5))){Simulator::failed_choices(argv[0], "SimulatorType(steady or unsteady) InitializationParticlesType(localized/discretized) GasType(constant, nonuniform, expression \"<f(x,t)>\") [index]\n");}
 	
 	
 	Simulator::Problem simulation(argv);
+	if (index){
+		simulation.index_bins = INDEX_BINS;
+	}
 	
 	simulation.solve();
 	simulation.solve_parallel();
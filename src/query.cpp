@@ -0,0 +1,31 @@
+//
+//  query.cpp
+//  air-pollution-simulator
+//
+//  Receptor index query tool: lists the particles found in a region during a time window.
+//
+
+#include <iostream>
+#include <cstdlib>
+#include "simulator.hpp"
+
+
+
+int main(int argc, const char * argv[]) {
+	if (argc != 6){Simulator::failed_choices(argv[0], "IndexFile(path_index.bin) xmin xmax tmin tmax\n");}
+	
+	Simulator::Chrono timer;
+	timer.start();
+	
+	Simulator::ReceptorIndex index(argv[1]);
+	auto ids = index.query(atof(argv[2]), atof(argv[3]), atof(argv[4]), atof(argv[5]));
+	
+	timer.stop();
+	
+	std::cout << "--- " << ids.size() << " particles in [" << argv[2] << ", " << argv[3] << "] during [" << argv[4] << ", " << argv[5] << "] ---" << std::endl;
+	std::for_each(ids.begin(), ids.end(), [](auto& id){std::cout << id << ",";});
+	std::cout << std::endl;
+	timer.print();
+	
+	return 0;
+}
@@ -6,6 +6,10 @@
 //
 
 #include "simulator.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
 
 
 /*------------------------TOOLS------------------------*/
@@ -46,13 +50,31 @@ Simulator::GasType Simulator::userChoice_GasType(const char * arg){
 		return GasType::Constant;
 	} else if (strcmp(arg, "nonuniform")==0){
 		return GasType::NonUniform;
+	} else if (strcmp(arg, "expression")==0){
+		return GasType::Expression;
 	}
 	else{
-		failed_choices(arg, "rather than: (constant, nonuniform)");
+		failed_choices(arg, "rather than: (constant, nonuniform, expression)");
 	}
 	return GasType::Constant;
 }
 
+std::unique_ptr<GasField> Simulator::make_gas_field(GasType const& Gas_type, std::string const& expression){
+	switch (Gas_type){
+		case GasType::Constant:
+			return std::make_unique<ConstantGasField>();
+		case GasType::NonUniform:
+			return std::make_unique<NonUniformGasField>();
+		case GasType::Expression:
+			return std::make_unique<ExpressionGasField>(expression);
+	}
+	return nullptr;
+}
+
+double Simulator::discretized_position(unsigned long int i, unsigned long int nbpart){
+	return -1.0 + (double)i*2.0/(double)nbpart;
+}
+
 /*------------------------ARRAY------------------------*/
 unsigned long int Array::size() const{
 	return data.size();
@@ -92,20 +114,456 @@ const double& Array::operator[](int i) const{
 	return data[i];
 }
 
+/*------------------------SPATIALORDER------------------------*/
+void Simulator::radix_sort(std::vector<std::uint32_t>& keys, std::vector<unsigned long int>& values){
+	const unsigned long int n = keys.size();
+	//Small inputs are sorted by a single block on the calling thread
+	const unsigned int nblocks = n < SERIAL_THRESHOLD ? 1 : NTHREADS;
+	auto for_each_block = [nblocks](auto&& task){
+		if (nblocks == 1){
+			task(0u);
+			return;
+		}
+		std::thread threads[NTHREADS];
+		for (unsigned int i = 0; i<nblocks; ++i) {
+			threads[i] = std::thread(task, i);
+		}
+		for (unsigned int i = 0; i<nblocks; ++i){
+			threads[i].join();
+		}
+	};
+	std::vector<std::uint32_t> keys_tmp(n);
+	std::vector<unsigned long int> values_tmp(n);
+	//One histogram of 256 digits per block
+	std::vector<unsigned long int> offsets(nblocks*256);
+	for (unsigned int shift = 0; shift<32; shift += 8) {
+		std::fill(offsets.begin(), offsets.end(), 0);
+		for_each_block([&, shift](unsigned int i){
+			for (unsigned long int j = i*n/nblocks; j<(i+1)*n/nblocks; ++j){
+				++offsets[i*256 + ((keys[j] >> shift) & 0xFF)];
+			}
+		});
+		//Exclusive prefix sum, digit major then block, keeps the sort stable
+		unsigned long int offset = 0;
+		for (unsigned int digit = 0; digit<256; ++digit){
+			for (unsigned int i = 0; i<nblocks; ++i){
+				const unsigned long int count = offsets[i*256 + digit];
+				offsets[i*256 + digit] = offset;
+				offset += count;
+			}
+		}
+		for_each_block([&, shift](unsigned int i){
+			for (unsigned long int j = i*n/nblocks; j<(i+1)*n/nblocks; ++j){
+				const unsigned long int dest = offsets[i*256 + ((keys[j] >> shift) & 0xFF)]++;
+				keys_tmp[dest] = keys[j];
+				values_tmp[dest] = values[j];
+			}
+		});
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+double Simulator::max_abs_difference(Array const& a, Array const& b){
+	const unsigned long int n = a.size();
+	if (n < SERIAL_THRESHOLD){
+		double change = 0.0;
+		for (unsigned long int j = 0; j<n; ++j){
+			change = std::max(change, std::abs(a[j] - b[j]));
+		}
+		return change;
+	}
+	double partial[NTHREADS] = {};
+	std::thread threads[NTHREADS];
+	for (unsigned int i = 0; i<NTHREADS; ++i) {
+		threads[i] = std::thread([&, i](){
+			double local = 0.0;
+			for (unsigned long int j = i*n/NTHREADS; j<(i+1)*n/NTHREADS; ++j){
+				local = std::max(local, std::abs(a[j] - b[j]));
+			}
+			partial[i] = local;
+		});
+	}
+	for (unsigned int i = 0; i<NTHREADS; ++i){
+		threads[i].join();
+	}
+	return *std::max_element(partial, partial+NTHREADS);
+}
+
+SpatialOrder::SpatialOrder(const unsigned long int size) : ids(size){
+	std::iota(ids.begin(), ids.end(), 0);
+}
+
+void SpatialOrder::set_period(unsigned int k){
+	period = k;
+}
+
+bool SpatialOrder::due(unsigned long int step) const{
+	return period != 0 && step % period == 0;
+}
+
+void SpatialOrder::sort(Array const& positions){
+	const unsigned long int n = positions.size();
+	const auto [lo, hi] = std::minmax_element(positions.begin(), positions.end());
+	const double min = n ? *lo : 0.0;
+	const double range = n ? *hi - *lo : 0.0;
+	
+	std::vector<std::uint32_t> keys(n);
+	std::transform(positions.begin(), positions.end(), keys.begin(), [min, range](auto& position){
+		const double scale = (double)std::numeric_limits<std::uint32_t>::max();
+		return range > 0 ? (std::uint32_t)((position-min)/range*scale) : (std::uint32_t)0;
+	});
+	perm.resize(n);
+	std::iota(perm.begin(), perm.end(), 0);
+	Simulator::radix_sort(keys, perm);
+	
+	std::vector<unsigned long int> sorted_ids(n);
+	std::transform(perm.begin(), perm.end(), sorted_ids.begin(), [this](auto& p){
+		return ids[p];
+	});
+	ids = std::move(sorted_ids);
+	sorted = true;
+}
+
+void SpatialOrder::restore(Array& values) const{
+	if (!sorted){
+		return;
+	}
+	Array original(values.size());
+	for (unsigned long int i = 0; i<ids.size(); ++i){
+		original[ids[i]] = values[i];
+	}
+	values = std::move(original);
+}
+
+void SpatialOrder::reset(){
+	std::iota(ids.begin(), ids.end(), 0);
+	sorted = false;
+}
+
+void SpatialOrder::permute(Array& values) const{
+	Array sorted(values.size());
+	std::transform(perm.begin(), perm.end(), sorted.begin(), [&values](auto& p){
+		return values[p];
+	});
+	values = std::move(sorted);
+}
+
+unsigned long int SpatialOrder::id(unsigned long int i) const{
+	return ids[i];
+}
+
+void SpatialOrder::print(Array const& values, std::ofstream& file) const{
+	if (!sorted){
+		values.print(file);
+		return;
+	}
+	Array original(values.size());
+	for (unsigned long int i = 0; i<ids.size(); ++i){
+		original[ids[i]] = values[i];
+	}
+	original.print(file);
+}
+
 /*------------------------GASFIELD------------------------*/
+void GasField::velocities(double* velocities, const double* positions, unsigned long int n, double time){
+	for (unsigned long int i = 0; i<n; ++i){
+		velocities[i] = velocity(positions[i], time);
+	}
+}
+
 double ConstantGasField::velocity(double position, double time){
 	return 1;
 }
 
+void ConstantGasField::velocities(double* velocities, const double* /*positions*/, unsigned long int n, double /*time*/){
+	std::fill(velocities, velocities+n, 1.0);
+}
+
 double NonUniformGasField::velocity(double position, double time){
 	return sin(-M_PI*position);
 }
 
+void NonUniformGasField::velocities(double* velocities, const double* positions, unsigned long int n, double /*time*/){
+	for (unsigned long int i = 0; i<n; ++i){
+		velocities[i] = sin(-M_PI*positions[i]);
+	}
+}
+
+/*------------------------EXPRESSION GASFIELD------------------------*/
+//Runs a binary operation over the BATCH lanes of the registers
+template<class F>
+static inline void lanes(double* __restrict dst, const double* __restrict a, const double* __restrict b, F f){
+	for (unsigned int l = 0; l<BATCH; ++l){
+		dst[l] = f(a[l], b[l]);
+	}
+}
+
+ExpressionGasField::ExpressionGasField(std::string const& expression) : source(expression){
+	result = parse_sum();
+	while (cursor < source.size() && isspace(source[cursor])){
+		++cursor;
+	}
+	if (cursor != source.size()){
+		fail("unexpected character");
+	}
+}
+
+void ExpressionGasField::fail(const char* message) const{
+	std::cerr << "Error: " << message << " at " << cursor << " in expression \"" << source << "\"\n";
+	exit(EXIT_FAILURE);
+}
+
+bool ExpressionGasField::accept(char c){
+	while (cursor < source.size() && isspace(source[cursor])){
+		++cursor;
+	}
+	if (cursor < source.size() && source[cursor] == c){
+		++cursor;
+		return true;
+	}
+	return false;
+}
+
+unsigned int ExpressionGasField::constant(double value){
+	if (nregisters == MAX_REGISTERS){
+		fail("expression too long");
+	}
+	constants.emplace_back(nregisters, value);
+	return nregisters++;
+}
+
+unsigned int ExpressionGasField::emit(Op op, unsigned int a, unsigned int b){
+	//Folds operations on constants at compile time
+	auto value = [this](unsigned int reg, double& v){
+		auto it = std::find_if(constants.begin(), constants.end(), [reg](auto& c){return c.first == reg;});
+		if (it == constants.end()){
+			return false;
+		}
+		v = it->second;
+		return true;
+	};
+	double va = 0, vb = 0;
+	const bool unary = op >= Op::Neg;
+	if (value(a, va) && (unary || value(b, vb))){
+		return constant(apply(op, va, vb));
+	}
+	if (nregisters == MAX_REGISTERS){
+		fail("expression too long");
+	}
+	program.push_back({op, nregisters, a, b});
+	return nregisters++;
+}
+
+double ExpressionGasField::apply(Op op, double a, double b){
+	switch (op){
+		case Op::Add: return a+b;
+		case Op::Sub: return a-b;
+		case Op::Mul: return a*b;
+		case Op::Div: return a/b;
+		case Op::Pow: return std::pow(a, b);
+		case Op::Neg: return -a;
+		case Op::Sin: return std::sin(a);
+		case Op::Cos: return std::cos(a);
+		case Op::Tan: return std::tan(a);
+		case Op::Exp: return std::exp(a);
+		case Op::Log: return std::log(a);
+		case Op::Sqrt: return std::sqrt(a);
+		case Op::Abs: return std::abs(a);
+		case Op::Tanh: return std::tanh(a);
+	}
+	return 0;
+}
+
+unsigned int ExpressionGasField::parse_sum(){
+	unsigned int reg = parse_product();
+	while (true){
+		if (accept('+')){
+			reg = emit(Op::Add, reg, parse_product());
+		} else if (accept('-')){
+			reg = emit(Op::Sub, reg, parse_product());
+		} else {
+			return reg;
+		}
+	}
+}
+
+unsigned int ExpressionGasField::parse_product(){
+	unsigned int reg = parse_unary();
+	while (true){
+		if (accept('*')){
+			reg = emit(Op::Mul, reg, parse_unary());
+		} else if (accept('/')){
+			reg = emit(Op::Div, reg, parse_unary());
+		} else {
+			return reg;
+		}
+	}
+}
+
+unsigned int ExpressionGasField::parse_unary(){
+	if (accept('-')){
+		return emit(Op::Neg, parse_unary());
+	}
+	if (accept('+')){
+		return parse_unary();
+	}
+	return parse_power();
+}
+
+unsigned int ExpressionGasField::parse_power(){
+	const unsigned int base = parse_primary();
+	if (accept('^')){
+		return emit(Op::Pow, base, parse_unary());
+	}
+	return base;
+}
+
+unsigned int ExpressionGasField::parse_primary(){
+	if (accept('(')){
+		const unsigned int reg = parse_sum();
+		if (!accept(')')){
+			fail("missing ')'");
+		}
+		return reg;
+	}
+	if (cursor < source.size() && (isdigit(source[cursor]) || source[cursor] == '.')){
+		char* end = nullptr;
+		const double value = strtod(source.c_str()+cursor, &end);
+		cursor = end - source.c_str();
+		return constant(value);
+	}
+	std::size_t start = cursor;
+	while (cursor < source.size() && isalpha(source[cursor])){
+		++cursor;
+	}
+	const std::string name = source.substr(start, cursor-start);
+	if (name == "x"){
+		return 0;
+	}
+	if (name == "t"){
+		return 1;
+	}
+	if (name == "pi"){
+		return constant(M_PI);
+	}
+	const std::pair<const char*, Op> functions[] = {
+		{"sin", Op::Sin}, {"cos", Op::Cos}, {"tan", Op::Tan}, {"exp", Op::Exp},
+		{"log", Op::Log}, {"sqrt", Op::Sqrt}, {"abs", Op::Abs}, {"tanh", Op::Tanh}
+	};
+	for (auto& [function, op] : functions){
+		if (name == function){
+			if (!accept('(')){
+				fail("missing '(' after function");
+			}
+			const unsigned int reg = emit(op, parse_sum());
+			if (!accept(')')){
+				fail("missing ')'");
+			}
+			return reg;
+		}
+	}
+	cursor = start;
+	fail(name.empty() ? "expected a value" : "unknown name");
+	return 0;
+}
+
+double ExpressionGasField::velocity(double position, double time){
+	//Single lane run of the program on the stack, so concurrent calls share nothing
+	double registers[MAX_REGISTERS];
+	registers[0] = position;
+	registers[1] = time;
+	for (auto& [reg, value] : constants){
+		registers[reg] = value;
+	}
+	for (auto& ins : program){
+		registers[ins.dst] = apply(ins.op, registers[ins.a], registers[ins.b]);
+	}
+	return registers[result];
+}
+
+void ExpressionGasField::velocities(double* velocities, const double* positions, unsigned long int n, double time){
+	std::vector<double> registers(nregisters*BATCH, 0.0);
+	std::fill(registers.begin()+BATCH, registers.begin()+2*BATCH, time);
+	for (auto& [reg, value] : constants){
+		std::fill(registers.begin()+reg*BATCH, registers.begin()+(reg+1)*BATCH, value);
+	}
+	
+	for (unsigned long int start = 0; start<n; start += BATCH){
+		//The last batch runs on full registers, the extra lanes are not copied out
+		const unsigned long int count = std::min((unsigned long int)BATCH, n-start);
+		std::copy(positions+start, positions+start+count, registers.begin());
+		for (auto& ins : program){
+			double* dst = &registers[ins.dst*BATCH];
+			const double* a = &registers[ins.a*BATCH];
+			const double* b = &registers[ins.b*BATCH];
+			switch (ins.op){
+				case Op::Add: lanes(dst, a, b, [](double u, double v){return u+v;}); break;
+				case Op::Sub: lanes(dst, a, b, [](double u, double v){return u-v;}); break;
+				case Op::Mul: lanes(dst, a, b, [](double u, double v){return u*v;}); break;
+				case Op::Div: lanes(dst, a, b, [](double u, double v){return u/v;}); break;
+				case Op::Pow: lanes(dst, a, b, [](double u, double v){return std::pow(u, v);}); break;
+				case Op::Neg: lanes(dst, a, b, [](double u, double){return -u;}); break;
+				case Op::Sin: lanes(dst, a, b, [](double u, double){return std::sin(u);}); break;
+				case Op::Cos: lanes(dst, a, b, [](double u, double){return std::cos(u);}); break;
+				case Op::Tan: lanes(dst, a, b, [](double u, double){return std::tan(u);}); break;
+				case Op::Exp: lanes(dst, a, b, [](double u, double){return std::exp(u);}); break;
+				case Op::Log: lanes(dst, a, b, [](double u, double){return std::log(u);}); break;
+				case Op::Sqrt: lanes(dst, a, b, [](double u, double){return std::sqrt(u);}); break;
+				case Op::Abs: lanes(dst, a, b, [](double u, double){return std::abs(u);}); break;
+				case Op::Tanh: lanes(dst, a, b, [](double u, double){return std::tanh(u);}); break;
+			}
+		}
+		std::copy(registers.begin()+result*BATCH, registers.begin()+result*BATCH+count, velocities+start);
+	}
+}
+
+/*------------------------SPECIES------------------------*/
+void SpeciesSet::add(Species const& s){
+	if (!(s.settling_velocity >= 0 && s.decay_rate >= 0 && s.transfer_coefficient >= 0)){
+		Simulator::failed_choices(s.name.c_str(), "with a non-negative settling velocity, decay rate and transfer coefficient");
+	}
+	species.push_back(s);
+}
+
+unsigned long int SpeciesSet::size() const{
+	return species.size();
+}
+
+void SpeciesSet::initialize(unsigned long int nbpart, std::string const& path){
+	mass.assign(species.size(), Array(nbpart, 1.0));
+	for (auto& s : species){
+		std::ofstream file(path+"_"+s.name+"_mass.csv", std::ios::trunc);
+		file.close();
+	}
+}
+
+void SpeciesSet::permute(SpatialOrder const& order){
+	for (unsigned long int s = 0; s<species.size(); ++s){
+		order.permute(mass[s]);
+	}
+}
+
+void SpeciesSet::restore(SpatialOrder const& order){
+	for (unsigned long int s = 0; s<species.size(); ++s){
+		order.restore(mass[s]);
+	}
+}
+
+void SpeciesSet::print(std::string const& path, SpatialOrder const& order) const{
+	for (unsigned long int s = 0; s<species.size(); ++s){
+		std::ofstream file(path+"_"+species[s].name+"_mass.csv", std::ios::app);
+		order.print(mass[s], file);
+		file.close();
+	}
+}
+
 /*------------------------MODEL------------------------*/
 void Model::compute_velocities(Array& velocities, Array const& positions, double time){
-	std::transform(positions.begin(), positions.end(),velocities.begin(), [this, &time](auto& position){
-		return this->gastype->velocity(position, time);
-	});
+	if (positions.size() == 0){
+		return;
+	}
+	compute_velocities(&velocities[0], &positions[0], positions.size(), time);
 }
 
 void Model::compute_positions(Array& positions, Array const& velocities, double time){
@@ -114,41 +572,338 @@ void Model::compute_positions(Array& positions, Array const& velocities, double
 	});
 }
 
+void Model::compute_velocities(double* velocities, const double* positions, unsigned long int n, double time){
+	gastype->velocities(velocities, positions, n, time);
+}
+
+void Model::compute_positions(double* positions, const double* velocities, unsigned long int n, double time){
+	std::transform(velocities, velocities+n, positions, positions, [&time](auto& velocitiy, auto& position){
+		return position+velocitiy * time;
+	});
+}
+
+void Model::compute_species(SpeciesSet& species, Array const& velocities, double time){
+	const unsigned long int n = velocities.size();
+	if (n == 0){
+		return;
+	}
+	const double* __restrict wind = &velocities[0];
+	for (unsigned long int s = 0; s<species.size(); ++s){
+		const Species& properties = species.species[s];
+		const double rate = properties.decay_rate + properties.settling_velocity/species.mixing_height;
+		const double transfer = properties.transfer_coefficient/species.mixing_height;
+		const double loss = std::exp(-rate * time);
+		double* __restrict mass = &species.mass[s][0];
+		if (transfer == 0){
+			for (unsigned long int i = 0; i<n; ++i){
+				mass[i] *= loss;
+			}
+			continue;
+		}
+		//Stronger wind deposits faster
+		for (unsigned long int i = 0; i<n; ++i){
+			mass[i] *= loss * std::exp(-transfer * std::abs(wind[i]) * time);
+		}
+	}
+}
+
+/*------------------------RECEPTOR INDEX------------------------*/
+//Trailer closing an index file
+struct IndexTrailer{
+	std::uint64_t magic;
+	std::uint64_t nbsteps;
+	std::uint64_t nbpart;
+	std::uint64_t nbins;
+	double xmin;
+	double xmax;
+	std::uint64_t table_offset;
+};
+static const std::uint64_t INDEX_MAGIC = 0x3230584449435052; //"RPCIDX02"
+//Cells of the quantized in-bin positions
+static const double INDEX_CELLS = 65536.0;
+
+unsigned int Simulator::ReceptorGrid::bin(double position) const{
+	if (!(position >= xmin)){
+		return 0;
+	}
+	if (position >= xmax){
+		return nbins+1;
+	}
+	return 1 + std::min(nbins-1, (unsigned int)((position-xmin)/width()));
+}
+
+double Simulator::ReceptorGrid::width() const{
+	return (xmax-xmin)/nbins;
+}
+
+double Simulator::ReceptorGrid::lower(unsigned int b) const{
+	return xmin + (double)(b-1)*width();
+}
+
+Simulator::ReceptorIndexWriter::ReceptorIndexWriter(std::string const& path, ReceptorGrid const& receptor_grid) : grid(receptor_grid){
+	if (grid.nbins == 0){
+		return;
+	}
+	file.open(path+"_index.bin", std::ios::binary | std::ios::trunc);
+	if (!file) {
+		std::cerr << "Error: File doesn't open.\n";
+		exit(EXIT_FAILURE);
+	}
+}
+
+void Simulator::ReceptorIndexWriter::add_step(double t, Array const& positions, SpatialOrder const& order){
+	if (!file.is_open()){
+		return;
+	}
+	nbpart = positions.size();
+	if (nbpart > UINT32_MAX){
+		std::cerr << "Error: The receptor index holds at most " << UINT32_MAX << " particles.\n";
+		exit(EXIT_FAILURE);
+	}
+	//Counting sort of the particles by bin, border bins 0 and nbins+1 hold the outside particles
+	const unsigned int nb = grid.nbins+2;
+	std::vector<unsigned int> bins(nbpart);
+	std::vector<std::uint32_t> bounds(nb+1, 0);
+	for (unsigned long int i = 0; i<nbpart; ++i){
+		bins[i] = grid.bin(positions[i]);
+		++bounds[bins[i]+1];
+	}
+	std::partial_sum(bounds.begin(), bounds.end(), bounds.begin());
+	std::vector<std::uint32_t> next(bounds.begin(), bounds.end()-1);
+	std::vector<std::uint32_t> ids(nbpart);
+	std::vector<std::uint16_t> cells(nbpart, 0);
+	std::vector<double> outside(bounds[1] + nbpart - bounds[nb-1]);
+	for (unsigned long int i = 0; i<nbpart; ++i){
+		const std::uint32_t r = next[bins[i]]++;
+		ids[r] = (std::uint32_t)order.id(i);
+		if (bins[i] == 0){
+			outside[r] = positions[i];
+		} else if (bins[i] == nb-1){
+			outside[bounds[1] + r - bounds[nb-1]] = positions[i];
+		} else {
+			const double cell = std::floor((positions[i]-grid.lower(bins[i]))/grid.width()*INDEX_CELLS);
+			cells[r] = (std::uint16_t)std::min(INDEX_CELLS-1.0, std::max(0.0, cell));
+		}
+	}
+	
+	times.push_back(t);
+	offsets.push_back(file.tellp());
+	file.write(reinterpret_cast<const char*>(bounds.data()), bounds.size()*sizeof(std::uint32_t));
+	file.write(reinterpret_cast<const char*>(ids.data()), ids.size()*sizeof(std::uint32_t));
+	file.write(reinterpret_cast<const char*>(cells.data()), cells.size()*sizeof(std::uint16_t));
+	file.write(reinterpret_cast<const char*>(outside.data()), outside.size()*sizeof(double));
+}
+
+void Simulator::ReceptorIndexWriter::close(){
+	if (!file.is_open()){
+		return;
+	}
+	const IndexTrailer trailer{INDEX_MAGIC, times.size(), nbpart, grid.nbins, grid.xmin, grid.xmax, (std::uint64_t)file.tellp()};
+	file.write(reinterpret_cast<const char*>(times.data()), times.size()*sizeof(double));
+	file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size()*sizeof(std::uint64_t));
+	file.write(reinterpret_cast<const char*>(&trailer), sizeof(IndexTrailer));
+	file.close();
+}
+
+void Simulator::ReceptorIndex::check(bool valid) const{
+	if (!valid) {
+		std::cerr << "Error: " << filename << " is not a valid receptor index.\n";
+		exit(EXIT_FAILURE);
+	}
+}
+
+void Simulator::ReceptorIndex::read_at(std::uint64_t offset, void* data, std::uint64_t size){
+	//Step blocks end before the step table
+	check(offset <= table_offset && size <= table_offset - offset);
+	file.seekg(offset);
+	file.read(reinterpret_cast<char*>(data), size);
+	check((bool)file);
+}
+
+Simulator::ReceptorIndex::ReceptorIndex(std::string const& index_file) : filename(index_file), file(index_file, std::ios::binary){
+	if (!file) {
+		std::cerr << "Error: File doesn't open.\n";
+		exit(EXIT_FAILURE);
+	}
+	file.seekg(0, std::ios::end);
+	const std::streamoff end = file.tellg();
+	check(file && end >= (std::streamoff)sizeof(IndexTrailer));
+	const std::uint64_t size = (std::uint64_t)end - sizeof(IndexTrailer);
+	IndexTrailer trailer{};
+	file.seekg(size);
+	file.read(reinterpret_cast<char*>(&trailer), sizeof(IndexTrailer));
+	check(file && trailer.magic == INDEX_MAGIC);
+	//The step table fills the space between the blocks and the trailer
+	const std::uint64_t entry = sizeof(double)+sizeof(std::uint64_t);
+	check(trailer.table_offset <= size && trailer.nbsteps == (size - trailer.table_offset)/entry
+		&& (size - trailer.table_offset)%entry == 0);
+	check(trailer.nbins > 0 && trailer.nbins < UINT32_MAX-2 && trailer.nbpart <= UINT32_MAX && trailer.xmin < trailer.xmax);
+	grid = {(unsigned int)trailer.nbins, trailer.xmin, trailer.xmax};
+	nbpart = trailer.nbpart;
+	table_offset = trailer.table_offset;
+	times.resize(trailer.nbsteps);
+	offsets.resize(trailer.nbsteps);
+	file.seekg(table_offset);
+	file.read(reinterpret_cast<char*>(times.data()), times.size()*sizeof(double));
+	file.read(reinterpret_cast<char*>(offsets.data()), offsets.size()*sizeof(std::uint64_t));
+	check((bool)file);
+	//Each block holds at least its bounds, IDs and cells
+	const std::uint64_t block = (grid.nbins+3)*sizeof(std::uint32_t) + nbpart*(sizeof(std::uint32_t)+sizeof(std::uint16_t));
+	for (unsigned long int step = 0; step<times.size(); ++step){
+		const std::uint64_t limit = step+1<times.size() ? offsets[step+1] : table_offset;
+		check(offsets[step] <= limit && block <= limit - offsets[step]);
+		check(step == 0 || times[step-1] <= times[step]);
+	}
+}
+
+unsigned long int Simulator::ReceptorIndex::steps() const{
+	return times.size();
+}
+
+std::vector<unsigned long int> Simulator::ReceptorIndex::query(double xmin, double xmax, double tmin, double tmax){
+	std::vector<unsigned long int> ids;
+	if (!(xmin <= xmax) || !(tmin <= tmax)){
+		return ids;
+	}
+	//Steps are exported in increasing time
+	const auto first = std::lower_bound(times.begin(), times.end(), tmin) - times.begin();
+	const auto last = std::upper_bound(times.begin(), times.end(), tmax) - times.begin();
+	const unsigned int nb = grid.nbins+2;
+	const unsigned int b0 = grid.bin(xmin);
+	const unsigned int b1 = grid.bin(xmax);
+	
+	std::vector<std::uint32_t> bounds(nb+1);
+	std::vector<std::uint32_t> records;
+	std::vector<std::uint16_t> cells;
+	std::vector<double> outside;
+	for (auto step = first; step<last; ++step){
+		const std::uint64_t ids_at = offsets[step] + bounds.size()*sizeof(std::uint32_t);
+		const std::uint64_t cells_at = ids_at + nbpart*sizeof(std::uint32_t);
+		const std::uint64_t outside_at = cells_at + nbpart*sizeof(std::uint16_t);
+		read_at(offsets[step], bounds.data(), bounds.size()*sizeof(std::uint32_t));
+		check(bounds.front() == 0 && bounds.back() == nbpart && std::is_sorted(bounds.begin(), bounds.end()));
+		const std::uint32_t begin = bounds[b0];
+		const std::uint32_t end = bounds[b1+1];
+		records.resize(end-begin);
+		cells.resize(end-begin);
+		read_at(ids_at + begin*sizeof(std::uint32_t), records.data(), records.size()*sizeof(std::uint32_t));
+		read_at(cells_at + begin*sizeof(std::uint16_t), cells.data(), cells.size()*sizeof(std::uint16_t));
+		for (unsigned int b = b0; b<=b1; ++b){
+			const bool border = b == 0 || b == nb-1;
+			if (border){
+				//Exact positions of the outside particles, underflow first
+				const std::uint64_t skip = b == 0 ? 0 : bounds[1];
+				outside.resize(bounds[b+1]-bounds[b]);
+				read_at(outside_at + skip*sizeof(double), outside.data(), outside.size()*sizeof(double));
+			}
+			for (std::uint32_t r = bounds[b]; r<bounds[b+1]; ++r){
+				bool found = true;
+				if (border){
+					const double x = outside[r-bounds[b]];
+					found = x >= xmin && x <= xmax;
+				} else if (b == b0 || b == b1){
+					const double cell = grid.width()/INDEX_CELLS;
+					const double x = grid.lower(b) + (double)cells[r-begin]*cell;
+					found = x+cell >= xmin && x <= xmax;
+				}
+				if (found){
+					ids.push_back(records[r-begin]);
+				}
+			}
+		}
+	}
+	//A particle staying in the region appears at every step of the window
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+	return ids;
+}
+
 /*------------------------SIMULATOR------------------------*/
-void Simulator::SteadySimulator::compute(Array& positions, Array& velocities, Model& particle_model, std::string& path){
+bool Simulator::EndCondition::reached(unsigned long int step, double t, double change) const{
+	return t >= horizon || change < tolerance || step >= max_steps;
+}
+
+unsigned long int Simulator::EndCondition::steps(double dt) const{
+	if (!(horizon < (double)max_steps*dt)){
+		return max_steps;
+	}
+	unsigned long int nbsteps = (unsigned long int)std::max(0.0, std::ceil(horizon/dt));
+	//horizon/dt may round to the wrong side of an integer, reached() tests step*dt >= horizon
+	if (nbsteps > 0 && (double)(nbsteps-1)*dt >= horizon){
+		--nbsteps;
+	}
+	if ((double)nbsteps*dt < horizon){
+		++nbsteps;
+	}
+	return std::min(nbsteps, max_steps);
+}
+
+void Simulator::SteadySimulator::compute(Array& positions, Array& velocities, SpeciesSet& species, Model& particle_model, SpatialOrder& order, std::string& path){
 	std::cout << " --- compute particle evolution at time: " << 0 << "---" << std::endl;
 	particle_model.compute_velocities(velocities, positions, 0);
 	particle_model.compute_positions(positions,velocities, 0);
+	particle_model.compute_species(species, velocities, 0);
 	
 	std::cout << "--- Export particles positions at time t = 0 in /Results ---" << std::endl;
 	std::ofstream file(path+"_positions.csv");
-	positions.print(file);
+	order.print(positions, file);
 	file.close();
+	ReceptorIndexWriter index(path, grid);
+	index.add_step(0, positions, order);
 	
 	std::cout << "--- Export particles velocities at time t = 0 in /Results  ---" << std::endl;
 	std::ofstream file2(path+"_velocities.csv");
-	velocities.print(file2);
+	order.print(velocities, file2);
 	file2.close();
+	species.print(path, order);
 }
 
-void Simulator::UnsteadySimulator::compute(Array& positions, Array& velocities, Model& particle_model, std::string& path){
+void Simulator::UnsteadySimulator::compute(Array& positions, Array& velocities, SpeciesSet& species, Model& particle_model, SpatialOrder& order, std::string& path){
 	double t = 0;
 	const double dt = 1.0/(double)N;
-	while (t<1) {
+	unsigned long int step = 0;
+	double change = std::numeric_limits<double>::infinity();
+	const bool converging = end.tolerance > 0;
+	Array previous;
+	ReceptorIndexWriter index(path, grid);
+	while (!end.reached(step, t, change)) {
 		std::cout << "--- Export particles positions at time t = " << t << " in /Results ---" << std::endl;
 		std::ofstream file(path+"_positions.csv", std::ios::app);
-		positions.print(file);
+		order.print(positions, file);
 		file.close();
+		index.add_step(t, positions, order);
 		
 		std::cout << "--- Export particles velocities at time t = " << t << " in /Results ---" << std::endl;
 		std::ofstream file2(path+"_velocities.csv", std::ios::app);
-		velocities.print(file2);
+		order.print(velocities, file2);
 		file2.close();
+		species.print(path, order);
 		
 		std::cout << "--- compute particle evolution at time: " << t << " ---" << std::endl;
-		t += dt;
-		particle_model.compute_velocities(velocities, positions, dt);
+		if (converging){
+			previous = positions;
+		}
+		particle_model.compute_velocities(velocities, positions, t);
 		particle_model.compute_positions(positions,velocities, dt);
+		particle_model.compute_species(species, velocities, dt);
+		if (converging){
+			change = max_abs_difference(positions, previous);
+		}
+		//Recomputed from the step count so long runs don't accumulate rounding errors
+		t = (double)(++step)*dt;
+		
+		if (order.due(step)){
+			std::cout << "--- reorder particles along the space-filling curve ---" << std::endl;
+			order.sort(positions);
+			order.permute(positions);
+			order.permute(velocities);
+			species.permute(order);
+		}
+	}
+	if (converging && change < end.tolerance){
+		std::cout << "--- converged at time t = " << t << " ---" << std::endl;
+	} else if (step >= end.max_steps && t < end.horizon){
+		std::cout << "--- Warning: stopped after " << step << " steps at time t = " << t << " without reaching the end condition ---" << std::endl;
 	}
 }
 
@@ -167,7 +922,7 @@ void Simulator::Particles::initialize(ComputeType const& Sim_type, ParticlesInit
 		case ParticlesInit_mod::Discretized:
 			std::cout << "--- init particles discretized ---" << std::endl;
 			std::transform(index.begin(), index.end(), position.begin(), [this](auto& indx){
-				return -1.0 + (double)indx*2.0/(double)nbpart;
+				return discretized_position(indx, nbpart);
 			});
 			break;
 		case ParticlesInit_mod::Localized:
@@ -180,17 +935,12 @@ void Simulator::Particles::initialize(ComputeType const& Sim_type, ParticlesInit
 			sim = std::make_unique<SteadySimulator>();
 			break;
 		case ComputeType::Unsteady:
-			sim = std::make_unique<UnsteadySimulator>();
-			break;
-	}
-	switch (Gas_type){
-		case GasType::Constant:
-			model.gastype = std::make_unique<ConstantGasField>();
-			break;
-		case GasType::NonUniform:
-			model.gastype = std::make_unique<NonUniformGasField>();
+			sim = std::make_unique<UnsteadySimulator>(end);
 			break;
 	}
+	sim->index_on(grid);
+	species.initialize(nbpart, path);
+	model.gastype = make_gas_field(Gas_type, gas_expression);
 }
 
 void Simulator::Particles::initialize_parallel(ComputeType const& Sim_type, ParticlesInit_mod const& Pos_type, GasType const& Gas_type, std::string& path){
@@ -212,7 +962,7 @@ void Simulator::Particles::initialize_parallel(ComputeType const& Sim_type, Part
 						std::vector<int> index(nbpart/NTHREADS);
 						std::iota(index.begin(), index.end(),i*nbpart/NTHREADS);
 						std::transform(index.begin(), index.end(), position.begin()+i*nbpart/NTHREADS, [this](auto& indx){
-					  return -1.0 + (double)indx*2.0/(double)nbpart;
+					  return discretized_position(indx, nbpart);
 				  });
 						
 					});
@@ -245,21 +995,221 @@ void Simulator::Particles::initialize_parallel(ComputeType const& Sim_type, Part
 			sim = std::make_unique<SteadySimulator>();
 			break;
 		case ComputeType::Unsteady:
-			sim = std::make_unique<UnsteadySimulator>();
+			sim = std::make_unique<UnsteadySimulator>(end);
 			break;
 	}
-	switch (Gas_type){
-		case GasType::Constant:
-			model.gastype = std::make_unique<ConstantGasField>();
-			break;
-		case GasType::NonUniform:
-			model.gastype = std::make_unique<NonUniformGasField>();
-			break;
+	sim->index_on(grid);
+	species.initialize(nbpart, path);
+	model.gastype = make_gas_field(Gas_type, gas_expression);
+}
+
+void Simulator::Particles::reorder_every(unsigned int k){
+	order.set_period(k);
+}
+
+void Simulator::Particles::set_end_condition(EndCondition const& end_condition){
+	if (!(end_condition.horizon > 0)){
+		failed_choices("EndCondition", "with a positive horizon");
+	}
+	if (!(end_condition.tolerance >= 0)){
+		failed_choices("EndCondition", "with a non-negative tolerance");
+	}
+	if (end_condition.max_steps == 0){
+		failed_choices("EndCondition", "with a positive steps cap");
+	}
+	if (std::isinf(end_condition.horizon) && !(end_condition.tolerance > 0)){
+		failed_choices("EndCondition", "with an infinite horizon needs a positive tolerance");
+	}
+	end = end_condition;
+}
+
+void Simulator::Particles::build_index(unsigned int nbins, double xmin, double xmax){
+	if (nbins == 0 || !(xmin < xmax)){
+		failed_choices("build_index", "with nbins > 0 and xmin < xmax");
 	}
+	grid = {nbins, xmin, xmax};
+}
+
+void Simulator::Particles::add_species(Species const& s){
+	species.add(s);
+}
+
+SpeciesSet const& Simulator::Particles::carried_species() const{
+	return species;
+}
+
+void Simulator::Particles::set_mixing_height(double height){
+	if (!(height > 0)){
+		failed_choices("set_mixing_height", "with a positive height");
+	}
+	species.mixing_height = height;
+}
+
+void Simulator::Particles::set_gas_expression(std::string const& expression){
+	gas_expression = expression;
 }
 
 void Simulator::Particles::compute(std::string& path){
-	sim->compute(position, velocity, model, path);
+	sim->compute(position, velocity, species, model, order, path);
+	//Gives the arrays back in particle ID order
+	order.restore(position);
+	order.restore(velocity);
+	species.restore(order);
+	order.reset();
+}
+
+/*------------------------OUT-OF-CORE PARTICLES------------------------*/
+//Page-aligned range covering n doubles from values
+static std::pair<char*, std::size_t> page_range(const double* values, unsigned long int n){
+	const std::uintptr_t page = sysconf(_SC_PAGESIZE);
+	const std::uintptr_t begin = (std::uintptr_t)values & ~(page-1);
+	const std::uintptr_t end = (std::uintptr_t)(values+n);
+	return {(char*)begin, end-begin};
+}
+
+//Asks the kernel to read ahead, then faults the pages in so the reads overlap the compute
+static void prefetch(const double* values, unsigned long int n){
+	if (n == 0){
+		return;
+	}
+	const auto [begin, length] = page_range(values, n);
+	madvise(begin, length, MADV_WILLNEED);
+	const std::size_t page = sysconf(_SC_PAGESIZE);
+	for (std::size_t offset = 0; offset<length; offset += page){
+		(void)*(volatile char*)(begin+offset);
+	}
+}
+
+//Starts the write-back of a finished chunk
+static void write_back(const double* values, unsigned long int n){
+	if (n == 0){
+		return;
+	}
+	const auto [begin, length] = page_range(values, n);
+	msync(begin, length, MS_ASYNC);
+}
+
+Simulator::OutOfCoreParticles::OutOfCoreParticles(unsigned long int i, std::string const& filename, unsigned long int chunk_size) : nbpart(i), chunk(std::max(chunk_size, 1ul)){
+	const std::size_t length = 2*nbpart*sizeof(double);
+	fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		std::cerr << "Error: " << filename << " doesn't open: " << strerror(errno) << "\n";
+		exit(EXIT_FAILURE);
+	}
+	if (ftruncate(fd, length) != 0) {
+		std::cerr << "Error: " << filename << " can't be resized: " << strerror(errno) << "\n";
+		exit(EXIT_FAILURE);
+	}
+	if (length == 0){
+		return;
+	}
+	void* mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		std::cerr << "Error: " << filename << " can't be mapped: " << strerror(errno) << "\n";
+		exit(EXIT_FAILURE);
+	}
+	state = (double*)mapping;
+}
+
+Simulator::OutOfCoreParticles::~OutOfCoreParticles(){
+	if (state){
+		munmap(state, 2*nbpart*sizeof(double));
+	}
+	if (fd >= 0){
+		close(fd);
+	}
+}
+
+void Simulator::OutOfCoreParticles::set_horizon(double horizon_time){
+	if (!(horizon_time > 0) || !std::isfinite(horizon_time)){
+		failed_choices("set_horizon", "with a positive finite horizon");
+	}
+	end.horizon = horizon_time;
+}
+
+void Simulator::OutOfCoreParticles::set_gas_expression(std::string const& expression){
+	gas_expression = expression;
+}
+
+void Simulator::OutOfCoreParticles::initialize(ParticlesInit_mod const& Pos_type, GasType const& Gas_type){
+	double* positions = state;
+	double* velocities = state+nbpart;
+	for (unsigned long int start = 0; start<nbpart; start += chunk){
+		const unsigned long int end = std::min(start+chunk, nbpart);
+		std::fill(velocities+start, velocities+end, 1);
+		switch (Pos_type){
+			case ParticlesInit_mod::Discretized:
+				for (unsigned long int i = start; i<end; ++i){
+					positions[i] = discretized_position(i, nbpart);
+				}
+				break;
+			case ParticlesInit_mod::Localized:
+				std::fill(positions+start, positions+end, 0.0);
+				break;
+		}
+		write_back(positions+start, end-start);
+		write_back(velocities+start, end-start);
+	}
+	model.gastype = make_gas_field(Gas_type, gas_expression);
+}
+
+void Simulator::OutOfCoreParticles::compute(){
+	const double dt = 1.0/(double)N;
+	//Same number of steps as the UnsteadySimulator time loop, capped at MAX_STEPS
+	const unsigned long int nbsteps = end.steps(dt);
+	if ((double)nbsteps*dt < end.horizon){
+		std::cout << "--- Warning: stopping after " << nbsteps << " steps at time t = " << (double)nbsteps*dt << " without reaching the end condition ---" << std::endl;
+	}
+	
+	double* positions = state;
+	double* velocities = state+nbpart;
+	prefetch(positions, std::min(chunk, nbpart));
+	prefetch(velocities, std::min(chunk, nbpart));
+	for (unsigned long int start = 0; start<nbpart; start += chunk){
+		const unsigned long int count = std::min(chunk, nbpart-start);
+		std::cout << "--- compute particles chunk [" << start << ", " << start+count << ") ---" << std::endl;
+		
+		const unsigned long int next = start+count;
+		const unsigned long int next_count = next<nbpart ? std::min(chunk, nbpart-next) : 0;
+		std::thread prefetcher([positions, velocities, next, next_count](){
+			prefetch(positions+next, next_count);
+			prefetch(velocities+next, next_count);
+		});
+		
+		std::thread threads[NTHREADS];
+		for (unsigned int i = 0; i<NTHREADS; ++i) {
+			threads[i] = std::thread([this, positions, velocities, start, count, nbsteps, dt, i](){
+				const unsigned long int begin = start + i*count/NTHREADS;
+				const unsigned long int n = (i+1)*count/NTHREADS - i*count/NTHREADS;
+				if (n == 0){
+					return;
+				}
+				for (unsigned long int step = 0; step<nbsteps; ++step){
+					model.compute_velocities(velocities+begin, positions+begin, n, (double)step*dt);
+					model.compute_positions(positions+begin, velocities+begin, n, dt);
+				}
+			});
+		}
+		for (unsigned int i = 0; i<NTHREADS; ++i){
+			threads[i].join();
+		}
+		prefetcher.join();
+		
+		write_back(positions+start, count);
+		write_back(velocities+start, count);
+	}
+}
+
+unsigned long int Simulator::OutOfCoreParticles::size() const{
+	return nbpart;
+}
+
+const double* Simulator::OutOfCoreParticles::position() const{
+	return state;
+}
+
+const double* Simulator::OutOfCoreParticles::velocity() const{
+	return state+nbpart;
 }
 
 /*------------------------Chrono------------------------*/
@@ -293,6 +1243,12 @@ void Simulator::Problem::solve() const{
 	
 	Particles p(nb_particles);
 	auto [compute_type, initializing_type, gas_type] = userChoice(argv);
+	if (gas_type == GasType::Expression){
+		p.set_gas_expression(argv[4]);
+	}
+	if (index_bins > 0){
+		p.build_index(index_bins);
+	}
 	p.initialize(compute_type, initializing_type, gas_type, path);
 	p.compute(path);
 	
@@ -307,6 +1263,12 @@ void Simulator::Problem::solve_parallel() const{
 	
 	Particles p(nb_particles);
 	auto [compute_type, initializing_type, gas_type] = userChoice(argv);
+	if (gas_type == GasType::Expression){
+		p.set_gas_expression(argv[4]);
+	}
+	if (index_bins > 0){
+		p.build_index(index_bins);
+	}
 	
 	
 	p.initialize_parallel(compute_type, initializing_type, gas_type, path);
@@ -45,3 +45,367 @@ TEST(ArrayTests, ArrayTestsOperators){
 	EXPECT_EQ(arr[0], 2);
 }
 
+
+
+TEST(SpatialOrderTests, RadixSortTest){
+	std::vector<std::uint32_t> keys = {7, 0xFFFFFFFF, 3, 256, 3, 0, 65536};
+	std::vector<unsigned long int> values(keys.size());
+	std::iota(values.begin(), values.end(), 0);
+	Simulator::radix_sort(keys, values);
+	
+	EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+	std::vector<unsigned long int> expected = {5, 2, 4, 0, 3, 6, 1};
+	EXPECT_EQ(values, expected);
+}
+
+TEST(SpatialOrderTests, ReorderKeepsIdsTest){
+	Array positions(4);
+	positions[0] = 0.5; positions[1] = -1; positions[2] = 0.25; positions[3] = 0;
+	SpatialOrder order(4);
+	order.sort(positions);
+	order.permute(positions);
+	
+	for(int i = 1;i<4;++i){
+		EXPECT_LE(positions[i-1], positions[i]);
+	}
+	EXPECT_EQ(order.id(0), 1);
+	EXPECT_EQ(order.id(3), 0);
+	
+	std::ofstream file("test_order.csv", std::ios::trunc);
+	order.print(positions, file);
+	file.close();
+	std::ifstream in("test_order.csv");
+	std::string line;
+	std::getline(in, line);
+	EXPECT_EQ(line, "0.5,-1,0.25,0,");
+}
+
+
+static std::string read_file(const std::string& filename){
+	std::ifstream in(filename);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+TEST(SpatialOrderTests, ReorderedRunTest){
+	const unsigned int n = 64;
+	Simulator::Particles p(n), q(n);
+	std::string path = "test_reordered";
+	std::string reference_path = "test_not_reordered";
+	p.reorder_every(3);
+	p.add_species({"PM10", 0.1, 1.0});
+	q.add_species({"PM10", 0.1, 1.0});
+	p.set_gas_expression("sin(x - t)");
+	q.set_gas_expression("sin(x - t)");
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Expression, path);
+	q.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Expression, reference_path);
+	//Shuffled start so that the reordering really permutes the particles
+	for(unsigned int i = 0;i<n;++i){
+		p.position[i] = q.position[i] = Simulator::discretized_position((i*37)%n, n);
+	}
+	p.compute(path);
+	q.compute(reference_path);
+	
+	EXPECT_EQ(read_file(path+"_positions.csv"), read_file(reference_path+"_positions.csv"));
+	EXPECT_EQ(read_file(path+"_velocities.csv"), read_file(reference_path+"_velocities.csv"));
+	EXPECT_EQ(read_file(path+"_PM10_mass.csv"), read_file(reference_path+"_PM10_mass.csv"));
+	for(unsigned int i = 0;i<n;++i){
+		EXPECT_EQ(p.position[i], q.position[i]);
+		EXPECT_EQ(p.velocity[i], q.velocity[i]);
+	}
+}
+
+static unsigned long int count_lines(const std::string& filename){
+	std::ifstream in(filename);
+	std::string line;
+	unsigned long int lines = 0;
+	while (std::getline(in, line)){
+		++lines;
+	}
+	return lines;
+}
+
+TEST(EndConditionTests, HorizonTest){
+	Simulator::Particles p(8);
+	std::string path = "test_horizon";
+	p.set_end_condition(Simulator::EndCondition(2.0));
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Constant, path);
+	p.compute(path);
+	
+	EXPECT_GE(count_lines(path+"_positions.csv"), 2*N);
+	EXPECT_LE(count_lines(path+"_positions.csv"), 2*N+1);
+}
+
+TEST(EndConditionTests, ConvergenceTest){
+	Simulator::Particles p(8);
+	std::string path = "test_convergence";
+	p.set_end_condition(Simulator::EndCondition(std::numeric_limits<double>::infinity(), 1e-6));
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::NonUniform, path);
+	p.compute(path);
+	
+	//Particles inside (-1,1) settle on the stable point of sin(-pi x)
+	for(int i = 1;i<8;++i){
+		EXPECT_NEAR(p.position[i], 0, 1e-4);
+	}
+	EXPECT_GT(count_lines(path+"_positions.csv"), N);
+}
+
+
+TEST(EndConditionTests, StepsCapTest){
+	Simulator::Particles p(8);
+	std::string path = "test_steps_cap";
+	//A constant field moves every particle by dt each step and never converges
+	p.set_end_condition(Simulator::EndCondition(std::numeric_limits<double>::infinity(), 1e-3, 30));
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Constant, path);
+	p.compute(path);
+	
+	EXPECT_EQ(count_lines(path+"_positions.csv"), 30);
+	EXPECT_NEAR(p.position[0], -1.0 + 30.0/N, 1e-12);
+}
+
+
+TEST(EndConditionTests, StepCountTest){
+	const double dt = 1.0/(double)N;
+	//steps() matches the time loop, including horizons on a multiple of dt
+	for (double horizon : {0.3, 1.0, 2.0, 0.1*3.0, 7.0/N}){
+		Simulator::EndCondition end(horizon);
+		unsigned long int step = 0;
+		while (!end.reached(step, (double)step*dt, std::numeric_limits<double>::infinity())){
+			++step;
+		}
+		EXPECT_EQ(end.steps(dt), step);
+	}
+	EXPECT_EQ(Simulator::EndCondition(1e12).steps(dt), MAX_STEPS);
+	EXPECT_EQ(Simulator::EndCondition(std::numeric_limits<double>::infinity(), 1e-3, 30).steps(dt), 30);
+	
+	Simulator::OutOfCoreParticles ooc(8, "test_state_horizon.bin");
+	EXPECT_EXIT(ooc.set_horizon(0.0), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+	EXPECT_EXIT(ooc.set_horizon(std::numeric_limits<double>::infinity()), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+
+TEST(EndConditionTests, InvalidEndConditionTest){
+	Simulator::Particles p(8);
+	EXPECT_EXIT(p.set_end_condition(Simulator::EndCondition(std::nan(""))), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+	EXPECT_EXIT(p.set_end_condition(Simulator::EndCondition(0.0)), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+	EXPECT_EXIT(p.set_end_condition(Simulator::EndCondition(1.0, -1e-3)), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+	EXPECT_EXIT(p.set_end_condition(Simulator::EndCondition(std::numeric_limits<double>::infinity())), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+
+TEST(ReceptorIndexTests, QueryTest){
+	Simulator::Particles p(16);
+	std::string path = "test_index";
+	p.build_index(8);
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Constant, path);
+	p.compute(path);
+	
+	Simulator::ReceptorIndex index(path+"_index.bin");
+	EXPECT_GE(index.steps(), N);
+	
+	//Particles start at -1 + 2i/16 and move at velocity 1
+	auto at_start = index.query(-0.3, 0.1, 0, 0);
+	std::vector<unsigned long int> expected = {6, 7, 8};
+	EXPECT_EQ(at_start, expected);
+	
+	auto window = index.query(0.95, 2.0, 0.5, 0.6);
+	expected = {11, 12, 13, 14, 15};
+	EXPECT_EQ(window, expected);
+	
+	EXPECT_TRUE(index.query(5, 6, 0, 1).empty());
+}
+
+TEST(ReceptorIndexTests, CorruptIndexTest){
+	Simulator::Particles p(16);
+	std::string path = "test_corrupt";
+	p.build_index(8);
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Constant, path);
+	p.compute(path);
+	const std::string content = read_file(path+"_index.bin");
+	
+	//Truncated file: the trailer is missing
+	std::ofstream(path+"_truncated.bin", std::ios::binary) << content.substr(0, content.size()/2);
+	EXPECT_EXIT(Simulator::ReceptorIndex(path+"_truncated.bin"), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+	
+	//Corrupt bounds of the first step
+	std::string corrupt = content;
+	corrupt[sizeof(std::uint32_t)] = '\xff';
+	std::ofstream(path+"_bounds.bin", std::ios::binary) << corrupt;
+	Simulator::ReceptorIndex index(path+"_bounds.bin");
+	EXPECT_EXIT(index.query(-1, 1, 0, 0), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+
+TEST(SpeciesTests, BatchedSpeciesTest){
+	Simulator::Particles p(8);
+	std::string path = "test_species";
+	p.add_species({"NOx", 0.0, 0.0});
+	p.add_species({"PM25", 0.1, 0.0});
+	p.add_species({"PM10", 0.1, 2.0});
+	p.set_mixing_height(0.5);
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::NonUniform, path);
+	p.compute(path);
+	
+	auto& species = p.carried_species();
+	ASSERT_EQ(species.size(), 3);
+	for(int i = 0;i<8;++i){
+		//Species ride the particles, settling deposits over the mixing height: m = exp(-(k + w/H)*t)
+		EXPECT_DOUBLE_EQ(species.mass[0][i], 1.0);
+		EXPECT_NEAR(species.mass[1][i], std::exp(-0.2), 1e-12);
+		EXPECT_NEAR(species.mass[2][i], std::exp(-2.2), 1e-12);
+	}
+	EXPECT_EQ(count_lines(path+"_PM10_mass.csv"), N);
+}
+
+TEST(SpeciesTests, WindDepositionTest){
+	SpeciesSet species;
+	species.add({"PM10", 0.1, 0.5, 0.2});
+	species.mixing_height = 0.5;
+	species.initialize(3, "test_deposition");
+	Array velocities(3);
+	velocities[1] = 1.0;
+	velocities[2] = -2.0;
+	
+	Model model;
+	model.compute_species(species, velocities, 0.1);
+	//Deposition velocity w + c*|u| over the mixing height: m = exp(-(k + (w + c*|u|)/H)*dt)
+	EXPECT_NEAR(species.mass[0][0], std::exp(-0.1*(0.5 + 0.2)), 1e-12);
+	EXPECT_NEAR(species.mass[0][1], std::exp(-0.1*(0.5 + 0.6)), 1e-12);
+	EXPECT_NEAR(species.mass[0][2], std::exp(-0.1*(0.5 + 1.0)), 1e-12);
+	
+	EXPECT_EXIT(species.add({"NOx", 0.0, 0.0, -1.0}), ::testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+
+TEST(ExpressionGasFieldTests, EvaluateTest){
+	ExpressionGasField sine("sin(-pi*x)");
+	NonUniformGasField reference;
+	ExpressionGasField polynomial("2*x^2 - t/4 + -(x - 1) * exp(0)");
+	
+	//More positions than one batch, with a partial last batch
+	const unsigned long int n = 3*BATCH + 5;
+	std::vector<double> positions(n), velocities(n), expected(n);
+	for (unsigned long int i = 0; i<n; ++i){
+		positions[i] = -1.0 + (double)i*2.0/(double)n;
+	}
+	sine.velocities(velocities.data(), positions.data(), n, 0.3);
+	reference.velocities(expected.data(), positions.data(), n, 0.3);
+	for (unsigned long int i = 0; i<n; ++i){
+		EXPECT_DOUBLE_EQ(velocities[i], expected[i]);
+	}
+	
+	polynomial.velocities(velocities.data(), positions.data(), n, 0.4);
+	for (unsigned long int i = 0; i<n; ++i){
+		const double x = positions[i];
+		EXPECT_NEAR(velocities[i], 2*x*x - 0.1 - (x - 1), 1e-12);
+	}
+	EXPECT_DOUBLE_EQ(ExpressionGasField("x").velocity(0.25, 0), 0.25);
+	EXPECT_DOUBLE_EQ(ExpressionGasField("2^3^2 / (1+1)").velocity(0, 0), 256);
+	
+	//velocity() may run on several threads at once
+	std::vector<std::thread> threads;
+	std::vector<double> scalar(n);
+	for (unsigned int k = 0; k<NTHREADS; ++k){
+		threads.emplace_back([&, k](){
+			for (unsigned long int i = k; i<n; i += NTHREADS){
+				scalar[i] = polynomial.velocity(positions[i], 0.4);
+			}
+		});
+	}
+	for (auto& thread : threads){
+		thread.join();
+	}
+	for (unsigned long int i = 0; i<n; ++i){
+		EXPECT_DOUBLE_EQ(scalar[i], velocities[i]);
+	}
+	
+	std::string longest = "x";
+	for (unsigned int i = 0; i<MAX_REGISTERS; ++i){
+		longest += "+x";
+	}
+	EXPECT_EXIT(ExpressionGasField{longest}, ::testing::ExitedWithCode(EXIT_FAILURE), "");
+}
+
+TEST(ExpressionGasFieldTests, SimulateTest){
+	Simulator::Particles p(8), q(8);
+	std::string path = "test_expression";
+	std::string reference_path = "test_nonuniform";
+	p.set_gas_expression("sin(-pi*x)");
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Expression, path);
+	p.compute(path);
+	q.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::NonUniform, reference_path);
+	q.compute(reference_path);
+	
+	for(int i = 0;i<8;++i){
+		EXPECT_DOUBLE_EQ(p.position[i], q.position[i]);
+	}
+}
+
+
+TEST(ExpressionGasFieldTests, TimeDependentTest){
+	Simulator::Particles p(8), q(8);
+	std::string path = "test_expression_t";
+	p.set_gas_expression("t");
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Expression, path);
+	p.compute(path);
+	
+	//Steps k = 0..N-1 see the time k*dt: v = (N-1)*dt at the end, x = x0 + dt^2 * N(N-1)/2
+	const double dt = 1.0/(double)N;
+	for(int i = 0;i<8;++i){
+		EXPECT_NEAR(p.velocity[i], (N-1)*dt, 1e-12);
+		EXPECT_NEAR(p.position[i], -1.0 + i*2.0/8.0 + dt*dt*N*(N-1)/2.0, 1e-12);
+	}
+	
+	std::string wave_path = "test_expression_wave";
+	q.set_gas_expression("sin(x - t)");
+	q.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Expression, wave_path);
+	q.compute(wave_path);
+	ExpressionGasField wave("sin(x - t)");
+	for(int i = 0;i<8;++i){
+		double x = -1.0 + i*2.0/8.0;
+		for(int k = 0;k<N;++k){
+			EXPECT_DOUBLE_EQ(wave.velocity(x, k*dt), std::sin(x - k*dt));
+			x += std::sin(x - k*dt)*dt;
+		}
+		EXPECT_NEAR(q.position[i], x, 1e-12);
+	}
+}
+
+
+TEST(OutOfCoreTests, ChunkedComputeTest){
+	const unsigned int n = 1000;
+	Simulator::OutOfCoreParticles ooc(n, "test_state.bin", 96);
+	ooc.initialize(Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::NonUniform);
+	ooc.compute();
+	
+	Simulator::Particles p(n);
+	std::string path = "test_in_core";
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::NonUniform, path);
+	p.compute(path);
+	
+	ASSERT_EQ(ooc.size(), n);
+	for(unsigned int i = 0;i<n;++i){
+		EXPECT_DOUBLE_EQ(ooc.position()[i], p.position[i]);
+		EXPECT_DOUBLE_EQ(ooc.velocity()[i], p.velocity[i]);
+	}
+}
+
+TEST(OutOfCoreTests, TimeDependentFieldTest){
+	const unsigned int n = 500;
+	Simulator::OutOfCoreParticles ooc(n, "test_state_wave.bin", 64);
+	ooc.set_horizon(2.0);
+	ooc.set_gas_expression("sin(x - t)");
+	ooc.initialize(Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Expression);
+	ooc.compute();
+	
+	Simulator::Particles p(n);
+	std::string path = "test_in_core_wave";
+	p.set_end_condition(Simulator::EndCondition(2.0));
+	p.set_gas_expression("sin(x - t)");
+	p.initialize(Simulator::ComputeType::Unsteady, Simulator::ParticlesInit_mod::Discretized, Simulator::GasType::Expression, path);
+	p.compute(path);
+	
+	for(unsigned int i = 0;i<n;++i){
+		EXPECT_DOUBLE_EQ(ooc.position()[i], p.position[i]);
+		EXPECT_DOUBLE_EQ(ooc.velocity()[i], p.velocity[i]);
+	}
+}